@@ -3,12 +3,36 @@
 class WASMLayout{
     bodies = {};
     bodyList = [];
+    bodyOrderVersion = 0;
     springs = {};
     graph = null;
     nodeMass = this.defaultNodeMass;
     
     layoutEngine = null;
 
+//Force models compiled into the engine, see forceModels.hpp
+    engineClasses = {
+        classic: "WASMLayout",
+        forceAtlas2: "WASMLayoutForceAtlas2",
+        fruchtermanReingold: "WASMLayoutFruchtermanReingold"
+    };
+
+//2 or 3, 3D layouts use the octree engines
+    dimensions = 2;
+
+//Relaxation steps run on each newly added body
+    placementIterations = 20;
+
+//"auto" picks the direct all pairs engine or Barnes-Hut
+//each step, "direct" and "barnesHut" force one of them
+    forceEngine = "auto";
+
+//Warn once the heap is this full, checked every memoryCheckInterval steps
+    memoryWarningLevel = 0.85;
+    memoryCheckInterval = 120;
+    stepCount = 0;
+    memoryWarned = false;
+
     springLength = 80;
     springCoeff = 0.0015;
     springWeight = 1;
@@ -20,16 +44,26 @@ class WASMLayout{
         this.springLength = settings.springLength || this.springLength;
         this.springCoeff = settings.springCoeff || this.springCoeff;
         this.springWeight = settings.springWeight || this.springWeight;
+        this.dimensions = settings.dimensions || this.dimensions;
+        this.placementIterations = settings.placementIterations || this.placementIterations;
+        this.forceEngine = settings.forceEngine || this.forceEngine;
         graph.on('changed', e => {this.onGraphChanged(e);});
         var initBodyList = this.initBodies();
         var initSpringList = this.initLinks();
-        this.layoutEngine = new Module.WASMLayout(
+        var engineClass = this.engineClasses[settings.model || "classic"]
+            + (this.dimensions == 3 ? "3D" : "");
+        this.layoutEngine = new Module[engineClass](
             initBodyList,
             initSpringList,
             settings.gravity || -1.0,
             settings.theta || 0.5,
             settings.dragCoeff || 0.02,
             10);
+        this.layoutEngine.setForceEngine({
+            auto: Module.ForceEngine.AUTO,
+            barnesHut: Module.ForceEngine.BARNES_HUT,
+            direct: Module.ForceEngine.DIRECT
+        }[this.forceEngine]);
         console.log("layoutEngine Constructed")
     }
 
@@ -54,18 +88,33 @@ class WASMLayout{
         })
     }
 
+//Returns a random vector with the right number of
+//dimensions for the engine, centered on 0
+    randomVector(scale){
+        var v = {x: (scale*Math.random()) - scale/2, y: (scale*Math.random()) - scale/2};
+        if(this.dimensions == 3){
+            v.z = (scale*Math.random()) - scale/2;
+        }
+        return v;
+    }
+
+    zeroVector(){
+        return this.dimensions == 3 ? {x: 0, y: 0, z: 0} : {x: 0, y: 0};
+    }
+
     initBodies(){
         console.log("Node count: " + this.graph.getNodesCount());
-        var retBodies = Module.WASMLayout
+        var engineClass = this.dimensions == 3 ? Module.WASMLayout3D : Module.WASMLayout;
+        var retBodies = engineClass
             .getUninitializedBodies(this.graph.getNodesCount());
         var i = 0;
         this.graph.forEachNode(node => {
             let b = retBodies.get(i);
             b.id = node.id;
             b.pos = node.position;
-            b.pos = {x: (100*Math.random()) - 50, y: (100*Math.random()) - 50};
-            b.force = {x: 0, y: 0};
-            b.velocity = {x:(100*Math.random()) - 50, y:(100*Math.random()) - 50};
+            b.pos = this.randomVector(100);
+            b.force = this.zeroVector();
+            b.velocity = this.randomVector(100);
             b.isPinned = false;
             b.mass = this.nodeMass(node.id);
             retBodies.set(i, b);
@@ -101,19 +150,69 @@ class WASMLayout{
 
     step(){
         this.layoutEngine.step();
-        var xResPtr = this.layoutEngine.getXResVals();
-        var yResPtr = this.layoutEngine.getYResVals();
+//The engine periodically sorts its bodies in space, which
+//changes the order of the res arrays
+        var orderVersion = this.layoutEngine.getBodyOrderVersion();
+        if(orderVersion != this.bodyOrderVersion){
+            this.bodyOrderVersion = orderVersion;
+            var order = this.layoutEngine.getBodyList();
+            this.bodyList = [];
+            for(var i = 0; i < order.size(); i++){
+                this.bodyList.push(order.get(i));
+            }
+            order.delete();
+        }
+        var xResPtr = this.layoutEngine.getResVals(0);
+        var yResPtr = this.layoutEngine.getResVals(1);
+        var zResPtr = this.layoutEngine.getResVals(2);
         this.bodyList.forEach( (id, i) => {
             this.bodies[id].pos.x = Module.getValue(xResPtr + (i*4), "float");
             this.bodies[id].pos.y = Module.getValue(yResPtr + (i*4), "float");
+            if(zResPtr){
+                this.bodies[id].pos.z = Module.getValue(zResPtr + (i*4), "float");
+            }
         });
+        this.stepCount++;
+        if(this.stepCount % this.memoryCheckInterval == 0){
+            this.checkMemory();
+        }
         return false;
     }
 
+//Returns the engine's memory use per subsystem, in bytes
+    getMemoryUsage(){
+        return this.layoutEngine.getMemoryUsage();
+    }
+
+//Warns (once) when the wasm heap is close to full, as running
+//out aborts the engine with no other warning. A growable heap
+//is only full once it reaches its maximum size
+    checkMemory(){
+        var usage = this.getMemoryUsage();
+        if(!this.memoryWarned && usage.heapUsed > this.memoryWarningLevel * usage.heapMax){
+            this.memoryWarned = true;
+            console.warn("Layout engine heap is " +
+                Math.round(100 * usage.heapUsed / usage.heapMax) + "% full", usage);
+        }
+        return usage;
+    }
+
+//Compares the Barnes-Hut forces against the exact forces on the
+//current layout for each theta, and logs a table of the results
+    measureForceError(thetas){
+        thetas = thetas || [0.2, 0.4, 0.6, 0.8, 1.0, 1.2];
+        var res = thetas.map(theta => this.layoutEngine.measureForceError(theta));
+        console.table(res);
+        return res;
+    }
+
     getGraphRect(){
         let positions = this.layoutEngine.getGraphRect();
         let pos1 = positions.get(0);
         let pos2 = positions.get(1);
+        if(this.dimensions == 3){
+            return {x1: pos1.x, y1:pos1.y, z1:pos1.z, x2:pos2.x, y2:pos2.y, z2:pos2.z};
+        }
         return {x1: pos1.x, y1:pos1.y, x2:pos2.x, y2:pos2.y};
     }
 
@@ -184,15 +283,29 @@ class WASMLayout{
     initBody(node){
         var b = {}
         b.id = node.id
-        b.pos = {x: (1000*Math.random) - 500, y: (1000*Math.random) - 500};
-        b.force = {x: 0, y: 0};
-        b.velocity = {x:0, y:0};
+//Only used if the body ends up with no placed neighbours,
+//otherwise placeBody moves it next to them
+        b.pos = this.randomVector(1000);
+        b.force = this.zeroVector();
+        b.velocity = this.zeroVector();
         b.isPinned = false;
         b.mass = this.nodeMass(node.id);
         this.bodies[b.id] = b;
+        this.bodyList.push(b.id);
         this.setBody(b.id, b);
     }
 
+//Has the engine place a new body next to its neighbours, then
+//pulls the resulting position back into the js side body
+    placeBody(nodeId){
+        if(!this.layoutEngine.placeBody(nodeId, this.placementIterations)){
+            return false;
+        }
+        let pos = this.layoutEngine.getBody(nodeId).pos;
+        Object.assign(this.bodies[nodeId].pos, pos);
+        return true;
+    }
+
     initLink(link){
         var s = {}
         s.id = link.id;
@@ -219,11 +332,15 @@ class WASMLayout{
     noop(){}
 
     onGraphChanged(changes){
+//New bodies are placed once the whole batch is in, so
+//their links are known
+        var addedNodes = [];
         for (var i = 0; i < changes.length; ++i) {
             var change = changes[i];
             if (change.changeType === 'add') {
                 if (change.node) {
                     this.initBody(change.node);
+                    addedNodes.push(change.node.id);
                 }
                 if (change.link) {
                     this.initLink(change.link);
@@ -237,5 +354,15 @@ class WASMLayout{
                 }
             }
         }
+//A new body can only be placed once one of its neighbours
+//has been, so keep going until a pass places nothing
+        var pending = addedNodes.filter(id => this.bodies[id]);
+        while(pending.length > 0){
+            var remaining = pending.filter(id => !this.placeBody(id));
+            if(remaining.length == pending.length){
+                break;
+            }
+            pending = remaining;
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+//Accuracy vs throughput benchmark for the Barnes-Hut repulsion.
+//Builds synthetic reply-thread shaped graphs, lets them settle for a
+//few steps, then sweeps theta and compares against the exact forces
+#include "layout.hpp"
+#include <emscripten/emscripten.h>
+#include <cstdio>
+
+//Each new tweet replies to a random earlier one, which gives
+//roughly the same tree-ish shape as a real archive
+template <int D>
+void buildGraph(long count, std::vector<Body<D>>& bodies, std::vector<Spring>& springs){
+    std::default_random_engine re(1234);
+    std::uniform_real_distribution<float> posDist{-50, 50};
+    bodies = ClassicLayout<D>::getUninitializedBodies(count);
+    springs.clear();
+    for(long i = 0; i < count; i++){
+        bodies[i].id = std::to_string(i);
+        for(int d = 0; d < D; d++){
+            bodies[i].pos[d] = posDist(re);
+        }
+        bodies[i].mass = 1;
+        if(i > 0){
+            std::uniform_int_distribution<long> parentDist{0, i-1};
+            long parent = parentDist(re);
+            Spring s{};
+            s.id = std::to_string(i) + "-" + std::to_string(parent);
+            s.from = bodies[i].id;
+            s.to = std::to_string(parent);
+            s.weight = 1;
+            s.length = 80;
+            s.coeff = 0.0015;
+            springs.push_back(s);
+            bodies[parent].mass += 1/3.0;
+        }
+    }
+}
+
+//theta = 0 opens every node, so it should match the direct engine to
+//within float rounding. Anything more means bodies are missing from
+//the tree, and every other row of the sweep is wrong too
+const float maxExactError = 1e-3;
+
+template <int D>
+bool sweep(){
+    bool ok = true;
+    const long sizes[] = {500, 1000, 2000, 5000, 10000, 20000};
+    const float thetas[] = {0.2, 0.4, 0.6, 0.8, 1.0, 1.2};
+    const int settleSteps = 100;
+    for(auto size: sizes){
+        std::vector<Body<D>> bodies{};
+        std::vector<Spring> springs{};
+        buildGraph<D>(size, bodies, springs);
+        auto layout = new ClassicLayout<D>(bodies, springs, -1.0, 0.8, 0.02, 10);
+        for(int i = 0; i < settleSteps; i++){
+            layout->step();
+        }
+        auto check = layout->measureForceError(0);
+        if(check.maxError > maxExactError){
+            printf("%4d %8ld theta=0 max error %f, tree doesn't match the direct engine\n",
+                D, check.bodyCount, check.maxError);
+            ok = false;
+        }
+        for(auto theta: thetas){
+            auto stats = layout->measureForceError(theta);
+            printf("%4d %8ld %6.2f %10.5f %10.5f %10.1f %10.3f %10.3f %10.3f %10.3f\n",
+                D, stats.bodyCount, stats.theta, stats.rmsError, stats.maxError,
+                stats.nodeVisits, stats.buildTime, stats.approxTime,
+                stats.snapshotTime, stats.exactTime);
+        }
+        delete layout;
+    }
+    return ok;
+}
+
+int main(){
+//Times are microseconds per body, each engine's setup then its forces
+    printf("%4s %8s %6s %10s %10s %10s %10s %10s %10s %10s\n",
+        "dims", "bodies", "theta", "rmsErr", "maxErr", "visits",
+        "bh build", "bh walk", "dir snap", "dir pairs");
+    bool ok = sweep<2>();
+    ok = sweep<3>() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include "primitives.hpp"
+#include <cmath>
+
+#ifndef FORCEMODELS
+#define FORCEMODELS
+
+//Force model policies for Layout. Every function is static and
+//inline so each Layout<Repulsion, Attraction, Drag> combination
+//compiles down to straight line code in the inner loops
+
+//Repulsion policies return v such that the force on the source
+//body is v * (dx, dy), where (dx, dy) points from the source body
+//to the other charge and r is the length of (dx, dy). charge gives
+//a body's repulsive charge from its mass and the number of springs
+//attached to it, and is kept up to date by the engine
+
+//|F| = gravity * m1 * m2 / r^2, the original model
+struct InverseSquareRepulsion{
+    static inline float charge(float mass, long degree){
+        return mass;
+    }
+
+    static inline float coeff(float gravity, float c1, float c2, float r){
+        return gravity * c1 * c2 / (r * r * r);
+    }
+};
+
+//ForceAtlas2, |F| = gravity * (deg1 + 1) * (deg2 + 1) / r
+struct DegreeWeightedRepulsion{
+    static inline float charge(float mass, long degree){
+        return degree + 1;
+    }
+
+    static inline float coeff(float gravity, float c1, float c2, float r){
+        return gravity * c1 * c2 / (r * r);
+    }
+};
+
+//Fruchterman-Reingold, |F| = k^2 / r, with -gravity standing in
+//for k^2. Every body has the same charge
+struct FruchtermanReingoldRepulsion{
+    static inline float charge(float mass, long degree){
+        return 1;
+    }
+
+    static inline float coeff(float gravity, float c1, float c2, float r){
+        return gravity * c1 * c2 / (r * r);
+    }
+};
+
+//Attraction policies return v such that the force on spring->from
+//is v * (dx, dy), where (dx, dy) points from spring->from to
+//spring->to, and spring->to gets the opposite force
+
+//Hooke's law spring with a rest length, the original model
+struct HookeAttraction{
+    static inline double coeff(const Spring* spring, double r){
+        return (spring->coeff * (r - spring->length)) / (r * spring->weight);
+    }
+};
+
+//ForceAtlas2's lin-log mode, |F| = coeff * log(1 + r). Ignores
+//the spring length
+struct LinLogAttraction{
+    static inline double coeff(const Spring* spring, double r){
+        return (spring->coeff * std::log(1 + r)) / (r * spring->weight);
+    }
+};
+
+//Fruchterman-Reingold, |F| = coeff * r^2 / k, with the spring
+//length standing in for k
+struct FruchtermanReingoldAttraction{
+    static inline double coeff(const Spring* spring, double r){
+        return (spring->coeff * r) / (spring->length * spring->weight);
+    }
+};
+
+//Drag policies adjust body->force given the body's velocity
+
+//Drag proportional to velocity, the original model
+struct LinearDrag{
+    template <int D>
+    static inline void apply(Body<D>* body, float dragCoeff){
+        for(int d = 0; d < D; d++){
+            body->force[d] -= dragCoeff * body->velocity[d];
+        }
+    }
+};
+
+#endif
@@ -1,10 +1,16 @@
 #include "quadTree.hpp"
+#include "forceModels.hpp"
 #include <emscripten/bind.h>
 #include <algorithm>
 #include <time.h>
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <unordered_set>
+#include <cstdint>
+#include <malloc.h>
+#include <emscripten/heap.h>
 
 #ifndef LAYOUT
 #define LAYOUT
@@ -22,8 +28,10 @@ public:
     ThreadRunner(T* runnerObj){
         this->runnerObj = runnerObj;
         run.lock();
-        worker = new std::thread(&ThreadRunner::loopFunc, this);
+//Must be set before the thread starts, or loopFunc can see
+//it false and exit before any work is handed to it
         running = true;
+        worker = new std::thread(&ThreadRunner::loopFunc, this);
     }
 
 //Unlocks run, letting the loopFunc
@@ -45,6 +53,15 @@ public:
         done.lock();
         done.unlock();
     }
+
+//Waits for any work in progress, then stops and joins the worker
+    ~ThreadRunner(){
+        wait();
+        running = false;
+        run.unlock();//Ensure the worker can exit
+        worker->join();
+        delete worker;
+    }
 private:
 //Every time this acquires a lock on run, it runs
 //The lock on run it acquires must be free using a call
@@ -53,33 +70,99 @@ private:
     void loopFunc(){
         while(running){
             run.lock();
+            if(!running){
+                break;
+            }
             runnerObj->run(startPos, endPos);
             done.unlock();
         }
     }
+};
 
-    ~ThreadRunner(){
-        running = false;
-        run.unlock();//Ensure the worker can exit
-        worker->join();
-        delete worker;
-    }
+//Result of comparing the Barnes-Hut repulsion against the exact
+//all pairs repulsion for a single theta value. Times are in
+//microseconds per body, errors are relative to the exact force.
+//An engine's cost per body is its setup time plus its force time
+struct ForceErrorStats{
+    float theta = 0;
+    long bodyCount = 0;
+    float rmsError = 0;
+    float maxError = 0;
+    float nodeVisits = 0;//Mean per body
+    float buildTime = 0;//Barnes-Hut setup, building the tree
+    float approxTime = 0;//Barnes-Hut tree walks
+    float snapshotTime = 0;//Direct setup, copying the positions
+    float exactTime = 0;//Direct all pairs loop
 };
 
+//Bytes used per engine subsystem, for keeping an eye on the
+//fixed size wasm heap. Doubles as embind has no 64 bit integers
+struct MemoryUsage{
+    double bodies = 0;//Body pool, reserved
+    double springs = 0;//Spring pool, reserved
+    double treeNodes = 0;//Tree node pool, reserved
+    double buffers = 0;//Result arrays and the direct engine snapshot
+    double indexes = 0;//heapUsed less the above, mostly id strings and the id keyed maps
+    double total = 0;//Sum of the above
+    double peak = 0;//Highest heap footprint the allocator has seen, 0 if it doesn't track one
+    double heapUsed = 0;//Everything malloc'd
+    double heapSize = 0;//Current size of the wasm heap
+    double heapMax = 0;//Size the heap can grow to, heapSize if it can't grow
+};
+
+//Which repulsion engine a step uses. AUTO picks between
+//the other two each step, see Layout::chooseEngine
+enum ForceEngine{
+    AUTO = 0,
+    BARNES_HUT = 1,
+    DIRECT = 2
+};
+
+//The force laws are compile time policies (see forceModels.hpp) so
+//there's no dispatch per interaction. Each combination the js side
+//can pick from is registered as its own embind class at the bottom.
+//D is the number of spatial dimensions, 2 or 3
+template <int D, class Repulsion, class Attraction, class Drag>
 class Layout{
-    std::unordered_map<std::string, Body*> bodies{};
+//Bodies and springs are allocated from these, so they sit together
+//in memory and dispose can release them in bulk
+    Pool<Body<D>> bodyPool{};
+    Pool<Spring> springPool{};
+
+    std::unordered_map<std::string, Body<D>*> bodies{};
     std::unordered_map<std::string, Spring*> springs{};
 
-    std::pair<Vector2D, Vector2D> bb {{}, {}};
+    std::pair<Vector<D>, Vector<D>> bb {{}, {}};
 
 //List of body id's kept in sync with 
 //js side list to allow for high performance
 //return from step
     std::vector<std::string> bodyList{};
 
-    Node* root = nullptr;
+//Bodies in bodyList order, and each id's position in it. Spring
+//endpoints are stored as these positions, see resolveSpring
+    std::vector<Body<D>*> bodyPtrs{};
+    std::unordered_map<std::string, long> bodyIndex{};
+
+//Every reorderInterval steps the body storage is sorted along a
+//Morton curve, so bodies next to each other in bodyList are next to
+//each other in space and share most of their tree walk. The version
+//lets the js side know to fetch the new bodyList. Skipped while the
+//direct engine is in use, as it has no tree walk to speed up
+    long reorderInterval = 64;
+    long bodyOrderVersion = 0;
+
+//Spring id's attached to each body id, so placement
+//can find a body's neighbours without a scan
+    std::unordered_map<std::string, std::vector<std::string>> bodyLinks{};
+
+//Bodies added by setBody since the last step, which don't
+//have a simulated position yet
+    std::unordered_set<std::string> unplacedBodies{};
+
+    Node<D>* root = nullptr;
 
-    QuadTree qt;
+    SpaceTree<D> qt;
 
 //Physics constants
     float gravity = -1.0;
@@ -87,15 +170,167 @@ class Layout{
     float dragCoeff = 0.02;
     float timestep = 20;
 
-    float* xResVals = nullptr;
-    float* yResVals = nullptr;
+//One array of positions per dimension
+    float* resVals[D] = {};
+    long resCapacity = 0;
 
     std::vector<ThreadRunner<Layout>*> workers;
     bool isFirstStep = true;
+
+//Repulsion engine selection. Below directAlwaysBelow bodies the
+//direct engine always wins, above directNeverAbove Barnes-Hut always
+//wins, and in between the cheaper measured engine is used, with the
+//other one re-measured every engineProbeInterval steps. The crossover
+//is around 300 bodies natively, and moves with the build (SIMD or
+//not), so the band in between is left to measurement
+    ForceEngine engineMode = AUTO;
+    ForceEngine activeEngine = BARNES_HUT;
+    long directAlwaysBelow = 256;
+    long directNeverAbove = 2048;
+    long engineProbeInterval = 128;
+    long stepCount = 0;
+    long lastMeasured[3] = {-1, -1, -1};//Step each engine was last timed on, -1 if never
+    float engineCost[3] = {};//Smoothed microseconds per step
+    float setupTime = 0;//Tree build or snapshot, microseconds
+    std::atomic<long> forceTime{0};//Summed over workers, nanoseconds
+
+//Direct engine position snapshot, one array per dimension
+//so the inner loop reads contiguous floats
+    std::vector<float> snapPos[D];
+    std::vector<float> snapCharge{};
+    static const long directTileSize = 256;
+
+//Incremental placement settings. The relaxation only looks at
+//bodies within placementReach spring lengths of the new body,
+//and at most placementMaxBodies of those
+    float placementReach = 2.0;
+    long placementMaxBodies = 256;
+
+    std::uniform_real_distribution<float> randomDist{0,1};
+    std::default_random_engine re;
+
+    float random(){
+        return randomDist(re);
+    }
+
+    void linkSpring(Spring* s){
+        bodyLinks[s->from].push_back(s->id);
+        bodyLinks[s->to].push_back(s->id);
+        updateCharge(s->from);
+        updateCharge(s->to);
+    }
+
+//Recomputes a body's repulsive charge after its mass or
+//the springs attached to it change
+    void updateCharge(const std::string& id){
+        if(bodies.count(id)){
+            long degree = bodyLinks.count(id) ? bodyLinks[id].size() : 0;
+            auto b = bodies[id];
+            b->charge = Repulsion::charge(b->mass, degree);
+        }
+    }
+
+    void resolveSpring(Spring* s){
+        s->fromIdx = bodyIndex.count(s->from) ? bodyIndex[s->from] : -1;
+        s->toIdx = bodyIndex.count(s->to) ? bodyIndex[s->to] : -1;
+    }
+
+    void resolveSprings(){
+        for(auto p: springs){
+            resolveSpring(std::get<1>(p));
+        }
+    }
+
+//Rebuilds bodyIndex for bodyList from startPos onwards
+    void reindexBodies(long startPos){
+        for(long i = startPos; i < bodyList.size(); i++){
+            bodyIndex[bodyList[i]] = i;
+        }
+    }
+
+//Z-order key of a position within the box lo, lo + extent
+    static uint64_t mortonKey(const Vector<D>& pos, const Vector<D>& lo, float extent){
+        const int bits = 63 / D;
+        const uint64_t maxCell = ((uint64_t)1 << bits) - 1;
+//A float can't hold maxCell, and rounds it up to 1 << bits
+        const double scale = maxCell;
+        uint64_t key = 0;
+        uint64_t cells[D];
+        for(int d = 0; d < D; d++){
+            double t = extent > 0 ? (double)(pos[d] - lo[d]) / extent : 0;
+            t = std::min(std::max(t, 0.0), 1.0);
+            cells[d] = std::min((uint64_t)(t * scale), maxCell);
+        }
+        for(int bit = bits - 1; bit >= 0; bit--){
+            for(int d = D - 1; d >= 0; d--){
+                key = (key << 1) | ((cells[d] >> bit) & 1);
+            }
+        }
+        return key;
+    }
+
+//Sorts bodies along a Morton curve, moving them into a fresh pool
+//in the new order so neighbouring bodies are also neighbours in
+//memory, then remaps the spring endpoints. Must only be called
+//while the workers are idle, and invalidates the tree
+    void reorderBodies(){
+        long n = bodyList.size();
+        if(n < 2){
+            return;
+        }
+        Vector<D> lo = bodyPtrs[0]->pos;
+        Vector<D> hi = bodyPtrs[0]->pos;
+        for(auto b: bodyPtrs){
+            for(int d = 0; d < D; d++){
+                lo[d] = std::min(lo[d], b->pos[d]);
+                hi[d] = std::max(hi[d], b->pos[d]);
+            }
+        }
+        float extent = 0;
+        for(int d = 0; d < D; d++){
+            extent = std::max(extent, hi[d] - lo[d]);
+        }
+        std::vector<std::pair<uint64_t, long>> order(n);
+        for(long i = 0; i < n; i++){
+            order[i] = {mortonKey(bodyPtrs[i]->pos, lo, extent), i};
+        }
+        std::sort(order.begin(), order.end());
+        std::vector<std::string> newList(n);
+        std::vector<Body<D>*> newPtrs(n);
+        Pool<Body<D>> newPool{};
+        for(long i = 0; i < n; i++){
+            long oldPos = std::get<1>(order[i]);
+            newList[i] = std::move(bodyList[oldPos]);
+            newPtrs[i] = newPool.create(std::move(*bodyPtrs[oldPos]));
+            bodies[newList[i]] = newPtrs[i];
+            bodyPool.destroy(bodyPtrs[oldPos]);
+        }
+//The old pool's chunks are freed when newPool goes out of scope
+        bodyPool.swap(newPool);
+        bodyList.swap(newList);
+        bodyPtrs.swap(newPtrs);
+        reindexBodies(0);
+        resolveSprings();
+        root = nullptr;
+        bodyOrderVersion++;
+    }
+
+    void unlinkSpring(Spring* s){
+        for(auto bodyId: {s->from, s->to}){
+            if(bodyLinks.count(bodyId)){
+                auto& links = bodyLinks[bodyId];
+                links.erase(std::remove(links.begin(), links.end(), s->id), links.end());
+                if(links.size() < 1){
+                    bodyLinks.erase(bodyId);
+                }
+            }
+            updateCharge(bodyId);
+        }
+    }
 public:
 //Constructor - takes a vector of bodies initialized on the
 //js side
-    Layout(std::vector<Body> initBodies,
+    Layout(std::vector<Body<D>> initBodies,
            std::vector<Spring> initSprings,
            float gravity,
            float theta,
@@ -104,11 +339,18 @@ public:
     {
 //These bodies are set up on the js side and then passed in
         for(auto b: initBodies){
-            bodies[b.id] = new Body(b);
+            bodies[b.id] = bodyPool.create(b);
+            bodyIndex[b.id] = bodyList.size();
             bodyList.push_back(b.id);
+            bodyPtrs.push_back(bodies[b.id]);
         }
         for(auto s: initSprings){
-            springs[s.id] = new Spring(s);
+            springs[s.id] = springPool.create(s);
+            resolveSpring(springs[s.id]);
+            linkSpring(springs[s.id]);
+        }
+        for(auto id: bodyList){
+            updateCharge(id);
         }
         updateBounds();
         this->gravity = gravity;
@@ -125,38 +367,55 @@ public:
     void step(){
 //These are only set to null by the contructor or
 //by a growing of the bodyList
-        if(xResVals == nullptr){
-            xResVals = (float*)malloc(bodies.size()*sizeof(float));
-        }
-        if(yResVals == nullptr){
-            yResVals = (float*)malloc(bodies.size()*sizeof(float));
+        for(int d = 0; d < D; d++){
+            if(resVals[d] == nullptr){
+                resVals[d] = (float*)malloc(bodies.size()*sizeof(float));
+                resCapacity = bodies.size();
+            }
         }
 //If this is the first time step is called, we need to fake a step
 //and set up our worker thread to do the accumulateForces
         if(isFirstStep){
             for(long i = 0; i < bodyList.size(); i++){
-                xResVals[i] = bodies[bodyList[i]]->pos.x;
-                yResVals[i] = bodies[bodyList[i]]->pos.y;
+                for(int d = 0; d < D; d++){
+                    resVals[d][i] = bodyPtrs[i]->pos[d];
+                }
             }
 //Otherwise we integrate the forces the worker thread found between the
 //last step call and this one, and fill the res arrays with those forces,
 //and delete the old worker thread
         } else {
 //Wait for the workers to finish calculating body forces
-            for(int i = 0; i < workers.size(); i++){
-                workers[i]->wait();
-            }
+            waitForWorkers();
 //calculate the spring forces (O[N])
             for(auto p: springs){
                 auto id = std::get<0>(p);
                 auto spring = std::get<1>(p);
                 updateSpringForce(spring);
             }
+            if(stepCount % reorderInterval == 0 && activeEngine != DIRECT){
+                reorderBodies();
+            }
 //Set the new body positions (O[N]
-            integrateForces(xResVals, yResVals);
+            integrateForces();
+            recordEngineCost();
         }
-        qt.insertBodies(bodies);
-        root = qt.getRoot();
+        unplacedBodies.clear();
+        chooseEngine();
+        auto t0 = std::chrono::steady_clock::now();
+        if(activeEngine == DIRECT){
+            snapshotPositions();
+//Not rebuilt while the direct engine runs, so placeBody
+//falls back to a linear scan
+            root = nullptr;
+        } else {
+            qt.insertBodies(bodyPtrs);
+            root = qt.getRoot();
+        }
+        setupTime = std::chrono::duration<float, std::micro>(
+            std::chrono::steady_clock::now() - t0).count();
+        forceTime = 0;
+        stepCount++;
         long chunkLen = bodyList.size() / workers.size();
         for(int i = 0; i < workers.size(); i++){
             workers[i]->start(
@@ -167,13 +426,132 @@ public:
         isFirstStep = false;
     }
 
+//Picks the engine for the coming step
+    void chooseEngine(){
+        if(engineMode != AUTO){
+            activeEngine = engineMode;
+            return;
+        }
+        long n = bodyList.size();
+        if(n < directAlwaysBelow){
+            activeEngine = DIRECT;
+        } else if(n > directNeverAbove){
+            activeEngine = BARNES_HUT;
+        } else if(isStale(BARNES_HUT)){
+            activeEngine = BARNES_HUT;
+        } else if(isStale(DIRECT)){
+            activeEngine = DIRECT;
+        } else {
+            activeEngine = engineCost[DIRECT] < engineCost[BARNES_HUT] ? DIRECT : BARNES_HUT;
+        }
+    }
+
+    bool isStale(ForceEngine engine){
+        return lastMeasured[engine] < 0 || stepCount - lastMeasured[engine] > engineProbeInterval;
+    }
+
+//Folds the cost of the step that just finished into the
+//smoothed cost of the engine it used. Worker time is summed,
+//so divide by the worker count to get wall clock time
+    void recordEngineCost(){
+        float cost = setupTime + forceTime / (1000.0 * workers.size());
+        if(lastMeasured[activeEngine] < 0){
+            engineCost[activeEngine] = cost;
+        } else {
+            engineCost[activeEngine] = 0.8 * engineCost[activeEngine] + 0.2 * cost;
+        }
+        lastMeasured[activeEngine] = stepCount;
+    }
+
+    void snapshotPositions(){
+        long n = bodyList.size();
+        snapCharge.resize(n);
+        for(int d = 0; d < D; d++){
+            snapPos[d].resize(n);
+        }
+        for(long i = 0; i < n; i++){
+            auto b = bodyPtrs[i];
+            snapCharge[i] = b->charge;
+            for(int d = 0; d < D; d++){
+                snapPos[d][i] = b->pos[d];
+            }
+        }
+    }
+
+//Incremented every time the body storage is reordered,
+//at which point the js side should refetch getBodyList
+    long getBodyOrderVersion(){
+        return bodyOrderVersion;
+    }
+
+//Body id's in the order used by the res arrays
+    std::vector<std::string> getBodyList(){
+        return bodyList;
+    }
+
+    double bufferBytes(){
+        double res = D * resCapacity * sizeof(float);
+        res += snapCharge.capacity() * sizeof(float);
+        for(int d = 0; d < D; d++){
+            res += snapPos[d].capacity() * sizeof(float);
+        }
+        return res;
+    }
+
+    double engineBytes(){
+        return (double)bodyPool.bytesReserved() + springPool.bytesReserved()
+            + qt.bytesReserved() + bufferBytes();
+    }
+
+//Reports memory use per subsystem along with the state of the
+//whole heap, so the js side can warn before an out of memory abort
+    MemoryUsage getMemoryUsage(){
+        MemoryUsage res{};
+        res.bodies = bodyPool.bytesReserved();
+        res.springs = springPool.bytesReserved();
+        res.treeNodes = qt.bytesReserved();
+        res.buffers = bufferBytes();
+//mallinfo walks the whole heap, so it's only called here
+//rather than sampled every step
+        auto info = mallinfo();
+        res.heapUsed = info.uordblks;
+        res.indexes = std::max(0.0, res.heapUsed - engineBytes());
+        res.total = engineBytes() + res.indexes;
+        res.peak = info.usmblks;
+        res.heapSize = emscripten_get_heap_size();
+        res.heapMax = emscripten_get_heap_max();
+        return res;
+    }
+
+//Set how the repulsion engine is picked, see ForceEngine.
+//The mode indexes the cost tables, so anything else is ignored
+    void setForceEngine(ForceEngine mode){
+        if(mode == AUTO || mode == BARNES_HUT || mode == DIRECT){
+            engineMode = mode;
+        }
+    }
+
+//Returns the engine the last step used
+    ForceEngine getForceEngine(){
+        return activeEngine;
+    }
+
+//Blocks until every worker has finished its current chunk.
+//Safe to call when no work has been started
+    void waitForWorkers(){
+        for(int i = 0; i < workers.size(); i++){
+            workers[i]->wait();
+        }
+    }
+
 //This is /filthy/ but embind doesn't support
 //pointers to raw types so here we are
-    long getXResVals(){ return (long)xResVals;}
-    long getYResVals(){ return (long)yResVals;}
+    long getResVals(int dim){ return (dim >= 0 && dim < D) ? (long)resVals[dim] : 0;}
+    long getXResVals(){ return getResVals(0);}
+    long getYResVals(){ return getResVals(1);}
 
 //Returns top_left, bottom_right of graph bounding box
-    std::vector<Vector2D> getGraphRect(){
+    std::vector<Vector<D>> getGraphRect(){
         return {std::get<0>(bb), std::get<1>(bb)};
     }
 
@@ -194,18 +572,39 @@ public:
 
 //Frees all current used memory (basically a destructor)
     void dispose(){
+        waitForWorkers();
         for(auto b: bodies){
-            delete std::get<1>(b);
+            bodyPool.destroy(std::get<1>(b));
         }
         for(auto s: springs){
-            delete std::get<1>(s);
+            springPool.destroy(std::get<1>(s));
         }
+        bodyPool.release();
+        springPool.release();
         bodies.clear();
         springs.clear();
+        bodyList.clear();
+        bodyPtrs.clear();
+        bodyIndex.clear();
+        bodyLinks.clear();
+        unplacedBodies.clear();
+        root = nullptr;
+    }
+
+//Joins the workers before anything they use is freed
+    ~Layout(){
+        for(auto w: workers){
+            delete w;
+        }
+        workers.clear();
+        dispose();
+        for(int d = 0; d < D; d++){
+            free(resVals[d]);
+        }
     }
 
 //Returns a body by copy, id 0 if not found
-    Body getBody(std::string nodeId){
+    Body<D> getBody(std::string nodeId){
         if(bodies.count(nodeId)){
             return *(bodies[nodeId]);
         }
@@ -214,22 +613,34 @@ public:
 
 //Overwrites the body with given id
 //creating if not already present
-    void setBody(std::string id, Body b){
+    void setBody(std::string id, Body<D> b){
         if(bodies.count(id) < 1){
+//The workers index bodies and bodyList, so they
+//must be idle before either grows
+            waitForWorkers();
+            bodies[id] = bodyPool.create();
+            bodyIndex[id] = bodyList.size();
             bodyList.push_back(id);
+            bodyPtrs.push_back(bodies[id]);
+            unplacedBodies.insert(id);
 //Force a re-alloc of these as the bodyList may
 //now be longer than the original alloc length
-            if(xResVals != nullptr){
-                free(xResVals);
-                xResVals = nullptr;
-            }
-            if(yResVals != nullptr){
-                free(yResVals);
-                yResVals = nullptr;
+            for(int d = 0; d < D; d++){
+                if(resVals[d] != nullptr){
+                    free(resVals[d]);
+                    resVals[d] = nullptr;
+                }
             }
         }
         *(bodies[id]) = b;
-        updateBounds();
+        updateCharge(id);
+        updateBounds(bodies[id]);
+//Springs that arrived before this body can now be used
+        if(bodyLinks.count(id)){
+            for(auto linkId: bodyLinks[id]){
+                resolveSpring(springs[linkId]);
+            }
+        }
     }
 
 //Returns a spring by copy, id 0 if not found
@@ -242,41 +653,181 @@ public:
     }
 
     void setSpring(std::string id, Spring s){
+        if(springs.count(id) < 1){
+            springs[id] = springPool.create();
+        } else {
+            unlinkSpring(springs[id]);
+        }
         *(springs[id]) = s;
+        resolveSpring(springs[id]);
+        linkSpring(springs[id]);
     }
 
     void removeBody(std::string id){
         if(bodies.count(id)){
-            delete bodies[id];
+            waitForWorkers();
+//The tree still points at this body until the next step
+            root = nullptr;
+            if(bodyLinks.count(id)){
+                auto links = bodyLinks[id];
+                for(auto linkId: links){
+                    removeLink(linkId);
+                }
+            }
+            unplacedBodies.erase(id);
+            long pos = bodyIndex[id];
+            bodyPool.destroy(bodies[id]);
             bodies.erase(id);
-            bodyList.erase(std::remove(bodyList.begin(), bodyList.end(), id), bodyList.end());
+            bodyIndex.erase(id);
+            bodyList.erase(bodyList.begin() + pos);
+            bodyPtrs.erase(bodyPtrs.begin() + pos);
+            reindexBodies(pos);
+            resolveSprings();
             updateBounds();
         }
     }
 
     void removeLink(std::string id){
         if(springs.count(id)){
-            delete springs[id];
+            unlinkSpring(springs[id]);
+            springPool.destroy(springs[id]);
             springs.erase(id);
         }
     }
 
+//Places a body added since the last step at the barycentre of its
+//already placed neighbours, then relaxes it against the bodies around
+//it for the given number of iterations. Only the new body moves, and
+//the work is bounded by the size of its neighbourhood rather than the
+//size of the graph. Bodies with no placed neighbours are left where
+//the js side put them, and stay unplaced so other new bodies don't
+//anchor to them. Returns whether the body was placed
+    bool placeBody(std::string id, int iterations){
+        if(bodies.count(id) < 1 || bodyLinks.count(id) < 1){
+            return false;
+        }
+        waitForWorkers();
+        auto body = bodies[id];
+
+        std::vector<std::pair<Spring*, Body<D>*>> anchors{};
+        Vector<D> centre{};
+        float reach = 0;
+        for(auto linkId: bodyLinks[id]){
+            auto spring = springs[linkId];
+            auto otherId = spring->from == id ? spring->to : spring->from;
+            if(bodies.count(otherId) < 1 || unplacedBodies.count(otherId)){
+                continue;
+            }
+            auto other = bodies[otherId];
+            anchors.push_back({spring, other});
+            for(int d = 0; d < D; d++){
+                centre[d] += other->pos[d];
+            }
+            reach = std::max(reach, spring->length);
+        }
+        if(anchors.size() < 1){
+            return false;
+        }
+        unplacedBodies.erase(id);
+//A small random offset stops a body with a single neighbour
+//landing exactly on top of it
+        for(int d = 0; d < D; d++){
+            centre[d] = centre[d] / anchors.size() + (random() - 0.5) * 0.1 * reach;
+        }
+        body->pos = centre;
+        body->velocity = {};
+        body->force = {};
+
+        if(iterations > 0){
+            std::vector<Body<D>*> local{};
+            collectNearbyBodies(centre, placementReach * reach, local);
+            Vector<D> delta{}, f{};
+            for(int i = 0; i < iterations; i++){
+                f = {};
+                for(auto other: local){
+                    if(other == body){
+                        continue;
+                    }
+                    float r2 = 0;
+                    for(int d = 0; d < D; d++){
+                        delta[d] = other->pos[d] - body->pos[d];
+                        r2 += delta[d] * delta[d];
+                    }
+                    float r = std::sqrt(r2) + 0.000000001;//Avoiding div by 0
+                    float v = Repulsion::coeff(gravity, other->charge, body->charge, r);
+                    for(int d = 0; d < D; d++){
+                        f[d] += v * delta[d];
+                    }
+                }
+                for(auto anchor: anchors){
+                    auto spring = std::get<0>(anchor);
+                    auto other = std::get<1>(anchor);
+                    float r2 = 0;
+                    for(int d = 0; d < D; d++){
+                        delta[d] = other->pos[d] - body->pos[d];
+                        r2 += delta[d] * delta[d];
+                    }
+                    double r = std::sqrt(r2) + 0.000000001;
+                    float v = Attraction::coeff(spring, r);
+                    for(int d = 0; d < D; d++){
+                        f[d] += v * delta[d];
+                    }
+                }
+//Same speed limit as integrateForces, but with no momentum
+                float coeff = timestep / body->mass;
+                float step2 = 0;
+                for(int d = 0; d < D; d++){
+                    f[d] *= coeff;
+                    step2 += f[d] * f[d];
+                }
+                float stepLen = std::sqrt(step2);
+                for(int d = 0; d < D; d++){
+                    body->pos[d] += (stepLen > 1.0 ? f[d] / stepLen : f[d]) * timestep;
+                }
+            }
+        }
+        updateBounds(body);
+        return true;
+    }
+
+//Bodies within radius of centre, at most placementMaxBodies of them.
+//Uses the last step's tree when there is one. Otherwise it scans the
+//bodies, as building a tree is O(N log N) and would move coincident
+//bodies just to place one
+    void collectNearbyBodies(const Vector<D>& centre, float radius, std::vector<Body<D>*>& res){
+        if(root != nullptr){
+            qt.collectBodies(centre, radius, placementMaxBodies, res);
+            return;
+        }
+        float radius2 = radius * radius;
+        for(auto other: bodyPtrs){
+            if(res.size() >= placementMaxBodies){
+                break;
+            }
+            float dist2 = 0;
+            for(int d = 0; d < D; d++){
+                float diff = other->pos[d] - centre[d];
+                dist2 += diff * diff;
+            }
+            if(dist2 <= radius2){
+                res.push_back(other);
+            }
+        }
+    }
+
     void updateBounds(){
-        float x1 = 0, x2 = 0, y1 = 0, y2 = 0;
         for(auto p: bodies){
             updateBounds(std::get<1>(p));
         }
     }
 
-    void updateBounds(Body* b){
-        auto x1 = &(std::get<0>(bb).x);
-        auto y1 = &(std::get<0>(bb).y);
-        auto x2 = &(std::get<1>(bb).x);
-        auto y2 = &(std::get<1>(bb).y);
-        if(b->pos.x < *x1) *x1 = b->pos.x;
-        if(b->pos.y < *y1) *y1 = b->pos.y;
-        if(b->pos.x > *x2) *x2 = b->pos.x;
-        if(b->pos.y > *y2) *y2 = b->pos.y;
+    void updateBounds(Body<D>* b){
+        auto& lo = std::get<0>(bb);
+        auto& hi = std::get<1>(bb);
+        for(int d = 0; d < D; d++){
+            if(b->pos[d] < lo[d]) lo[d] = b->pos[d];
+            if(b->pos[d] > hi[d]) hi[d] = b->pos[d];
+        }
     }
 
 //At this point root is valid
@@ -284,11 +835,28 @@ public:
 //calculate the gravity + drag
 //forces, then find the spring forces
     void accumulateBodyForces(long startPos, long endPos){
-        std::vector<Node*> updateQueue{};
+        auto t0 = std::chrono::steady_clock::now();
+        if(activeEngine == DIRECT){
+            std::vector<Vector<D>> res(endPos - startPos);
+            updateDirectForces(startPos, endPos, res.data());
+            for(long i = startPos; i < endPos; i++){
+                auto b = bodyPtrs[i];
+                b->force = res[i - startPos];
+                updateDragForce(b);
+            }
+        } else {
+            accumulateTreeForces(startPos, endPos);
+        }
+        forceTime += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - t0).count();
+    }
+
+    void accumulateTreeForces(long startPos, long endPos){
+        std::vector<Node<D>*> updateQueue{};
         updateQueue.reserve(1024);
         for(long i = startPos; i < endPos; i++){
-            auto b = bodies[bodyList[i]];
-            b->force = {0, 0};
+            auto b = bodyPtrs[i];
+            b->force = {};
             updateBodyForce(b, root, updateQueue);
             updateDragForce(b);
         }
@@ -297,106 +865,239 @@ public:
 //At this point all b->force values are valid
 //Use this information to calculate the new
 //b->velocity and b->pos values
-    void integrateForces(float* xResVals, float* yResVals){
-        float dx = 0, dy = 0;
-        long i = 0;
+    void integrateForces(){
         for(long i = 0; i < bodyList.size(); i++){
-            auto id = bodyList[i];
-            auto body = bodies[id];
+            auto body = bodyPtrs[i];
             float coeff = timestep / body->mass;
-            body->velocity.x += coeff * body->force.x;
-            body->velocity.y += coeff * body->force.y;
-            float vx = body->velocity.x;
-            float vy = body->velocity.y;
-            float v = std::sqrt(vx * vx + vy * vy);
-            if(v > 1.0){
-                body->velocity = {vx / v, vy / v};
+            float v2 = 0;
+            for(int d = 0; d < D; d++){
+                body->velocity[d] += coeff * body->force[d];
+                v2 += body->velocity[d] * body->velocity[d];
+            }
+            float v = std::sqrt(v2);
+            for(int d = 0; d < D; d++){
+                if(v > 1.0){
+                    body->velocity[d] /= v;
+                }
+                body->pos[d] += body->velocity[d] * timestep;
+                resVals[d][i] = body->pos[d];
             }
-            body->pos.x += body->velocity.x * timestep;
-            body->pos.y += body->velocity.y * timestep;
-            xResVals[i] = body->pos.x;
-            yResVals[i] = body->pos.y;
             updateBounds(body);
         }
     }
 
-    void updateBodyForce(Body* sourceBody, Node* root, std::vector<Node*> &updateQueue){
+//Returns the number of tree nodes visited, which is only
+//used by the benchmark
+    long updateBodyForce(Body<D>* sourceBody, Node<D>* root, std::vector<Node<D>*> &updateQueue){
         updateQueue.clear();
-        float v, dx, dy, r, fx=0, fy=0;
+        float v, r;
+        Vector<D> delta{}, f{};
+        long visits = 0;
         updateQueue.push_back(root);
         while(updateQueue.size() > 0){
             auto node = updateQueue[updateQueue.size()-1];
             updateQueue.pop_back();
+            visits++;
             auto body = node->body;
             auto differentBody = body != sourceBody;
             if(body != nullptr && differentBody){
-                dx = body->pos.x - sourceBody->pos.x;
-                dy = body->pos.y - sourceBody->pos.y;
-                r = std::sqrt(dx*dx + dy*dy) + 0.000000001;//Avoiding div by 0
-                v = gravity * body->mass * sourceBody->mass / (r * r * r);
-                fx += v * dx;
-                fy += v * dy;
+                r = 0;
+                for(int d = 0; d < D; d++){
+                    delta[d] = body->pos[d] - sourceBody->pos[d];
+                    r += delta[d] * delta[d];
+                }
+                r = std::sqrt(r) + 0.000000001;//Avoiding div by 0
+                v = Repulsion::coeff(gravity, body->charge, sourceBody->charge, r);
+                for(int d = 0; d < D; d++){
+                    f[d] += v * delta[d];
+                }
             } else if(differentBody){
-                dx = (node->massX / node->mass) - sourceBody->pos.x;
-                dy = (node->massY / node->mass) - sourceBody->pos.y;
-                r = std::sqrt(dx*dx + dy*dy) + 0.000000001;//Avoiding div by 0
-                if((node->right - node->left) / r < theta){
-                    v = (gravity * node->mass * sourceBody->mass) / (r * r * r);
-                    fx += v * dx;
-                    fy += v * dy;
-                } else {
-                    if (node->q0 != nullptr) {
-                        updateQueue.push_back(node->q0);
+                r = 0;
+                for(int d = 0; d < D; d++){
+                    delta[d] = (node->massPos[d] / node->mass) - sourceBody->pos[d];
+                    r += delta[d] * delta[d];
+                }
+                r = std::sqrt(r) + 0.000000001;//Avoiding div by 0
+                if((node->hi[0] - node->lo[0]) / r < theta){
+                    v = Repulsion::coeff(gravity, node->mass, sourceBody->charge, r);
+                    for(int d = 0; d < D; d++){
+                        f[d] += v * delta[d];
                     }
-                    if (node->q1 != nullptr) {
-                        updateQueue.push_back(node->q1);
+                } else {
+                    for(int c = 0; c < Node<D>::childCount; c++){
+                        if (node->children[c] != nullptr) {
+                            updateQueue.push_back(node->children[c]);
+                        }
                     }
-                    if (node->q2 != nullptr) {
-                        updateQueue.push_back(node->q2);
+                }
+            }
+        }
+        for(int d = 0; d < D; d++){
+            sourceBody->force[d] += f[d];
+        }
+        return visits;
+    }
+
+//Direct O(N^2) repulsion from the position snapshot on bodies
+//[startPos, endPos), written to res. Targets are taken a tile at a
+//time, and every source streams past the tile while its positions
+//and accumulators stay in cache
+    void updateDirectForces(long startPos, long endPos, Vector<D>* res){
+        const long tileSize = directTileSize;
+        long n = snapCharge.size();
+        const float* pos[D];
+        for(int d = 0; d < D; d++){
+            pos[d] = snapPos[d].data();
+        }
+        const float* charge = snapCharge.data();
+        float acc[D][tileSize];
+        for(long tileStart = startPos; tileStart < endPos; tileStart += tileSize){
+            long tileLen = std::min(tileSize, endPos - tileStart);
+            for(int d = 0; d < D; d++){
+                for(long i = 0; i < tileLen; i++){
+                    acc[d][i] = 0;
+                }
+            }
+            for(long j = 0; j < n; j++){
+                float p[D];
+                for(int d = 0; d < D; d++){
+                    p[d] = pos[d][j];
+                }
+                float c = charge[j];
+                long self = j - tileStart;
+                for(long i = 0; i < tileLen; i++){
+                    float delta[D];
+                    float r2 = 0;
+                    for(int d = 0; d < D; d++){
+                        delta[d] = p[d] - pos[d][tileStart + i];
+                        r2 += delta[d] * delta[d];
                     }
-                    if (node->q3 != nullptr) {
-                        updateQueue.push_back(node->q3);
+                    float r = std::sqrt(r2) + 0.000000001f;//Avoiding div by 0
+                    float v = Repulsion::coeff(gravity, c, charge[tileStart + i], r);
+                    v = i == self ? 0 : v;
+                    for(int d = 0; d < D; d++){
+                        acc[d][i] += v * delta[d];
                     }
                 }
             }
+            for(long i = 0; i < tileLen; i++){
+                for(int d = 0; d < D; d++){
+                    res[tileStart - startPos + i][d] = acc[d][i];
+                }
+            }
         }
-        sourceBody->force.x += fx;
-        sourceBody->force.y += fy;
     }
 
-    void updateDragForce(Body* body){
-        body->force.x -= dragCoeff * body->velocity.x;
-        body->force.y -= dragCoeff * body->velocity.y;
+//Benchmark mode - runs the Barnes-Hut walk with the given theta and
+//the direct engine over the same snapshot of positions.
+//Building the tree can nudge coincident bodies apart, so positions
+//are restored afterwards along with the forces, and this can be
+//called between steps without disturbing the simulation
+    ForceErrorStats measureForceError(float theta){
+        ForceErrorStats res{};
+        res.theta = theta;
+        res.bodyCount = bodyList.size();
+        if(bodyList.size() < 2){
+            return res;
+        }
+        waitForWorkers();
+        std::vector<Body<D>*> snapshot(bodyPtrs);
+        std::vector<Vector<D>> savedPositions(snapshot.size());
+        std::vector<Vector<D>> savedForces(snapshot.size());
+        for(long i = 0; i < snapshot.size(); i++){
+            savedPositions[i] = snapshot[i]->pos;
+            savedForces[i] = snapshot[i]->force;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        qt.insertBodies(bodyPtrs);
+        root = qt.getRoot();
+        auto t1 = std::chrono::steady_clock::now();
+
+        float oldTheta = this->theta;
+        this->theta = theta;
+        std::vector<Vector<D>> approx(snapshot.size());
+        std::vector<Node<D>*> updateQueue{};
+        updateQueue.reserve(1024);
+        long visits = 0;
+        for(long i = 0; i < snapshot.size(); i++){
+            snapshot[i]->force = {};
+            visits += updateBodyForce(snapshot[i], root, updateQueue);
+            approx[i] = snapshot[i]->force;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        this->theta = oldTheta;
+
+        snapshotPositions();
+        auto t3 = std::chrono::steady_clock::now();
+        std::vector<Vector<D>> exact(snapshot.size());
+        updateDirectForces(0, snapshot.size(), exact.data());
+        auto t4 = std::chrono::steady_clock::now();
+
+        for(long i = 0; i < snapshot.size(); i++){
+            snapshot[i]->pos = savedPositions[i];
+            snapshot[i]->force = savedForces[i];
+        }
+//The tree was built from the nudged positions
+        root = nullptr;
+
+        double sumSq = 0;
+        float maxError = 0;
+        for(long i = 0; i < snapshot.size(); i++){
+            float mag2 = 0, diff2 = 0;
+            for(int d = 0; d < D; d++){
+                float diff = approx[i][d] - exact[i][d];
+                mag2 += exact[i][d] * exact[i][d];
+                diff2 += diff * diff;
+            }
+            float err = mag2 > 0 ? std::sqrt(diff2 / mag2) : 0;
+            sumSq += err * err;
+            maxError = std::max(maxError, err);
+        }
+        float n = snapshot.size();
+        res.rmsError = std::sqrt(sumSq / n);
+        res.maxError = maxError;
+        res.nodeVisits = visits / n;
+        res.buildTime = std::chrono::duration<float, std::micro>(t1 - t0).count() / n;
+        res.approxTime = std::chrono::duration<float, std::micro>(t2 - t1).count() / n;
+        res.snapshotTime = std::chrono::duration<float, std::micro>(t3 - t2).count() / n;
+        res.exactTime = std::chrono::duration<float, std::micro>(t4 - t3).count() / n;
+        return res;
+    }
+
+    void updateDragForce(Body<D>* body){
+        Drag::apply(body, dragCoeff);
     }
 
     void updateSpringForce(Spring* spring){
-//Little bit of safety
-        if(bodies.count(spring->from) < 1 || bodies.count(spring->to) < 1){
-            removeLink(spring->id);
+//Little bit of safety, springs to missing bodies are ignored
+//until the body turns up
+        if(spring->fromIdx < 0 || spring->toIdx < 0){
             return;
         }
-        auto body1 = bodies[spring->from];
-        auto body2 = bodies[spring->to];
-        auto length = spring->length;
-        auto dx = body2->pos.x - body1->pos.x;
-        auto dy = body2->pos.y - body1->pos.y;
-        auto r = std::sqrt(dx*dx + dy*dy) + 0.000000001;
-        auto d = r - length;
-        auto coeff = (spring->coeff * d) / (r * spring->weight);
+        auto body1 = bodyPtrs[spring->fromIdx];
+        auto body2 = bodyPtrs[spring->toIdx];
+        Vector<D> delta{};
+        float r2 = 0;
+        for(int d = 0; d < D; d++){
+            delta[d] = body2->pos[d] - body1->pos[d];
+            r2 += delta[d] * delta[d];
+        }
+        double r = std::sqrt(r2) + 0.000000001;
+        auto coeff = Attraction::coeff(spring, r);
 
-        body1->force.x += coeff * dx;
-        body1->force.y += coeff * dy;
-        body2->force.x -= coeff * dx;
-        body2->force.y -= coeff * dy;
+        for(int d = 0; d < D; d++){
+            body1->force[d] += coeff * delta[d];
+            body2->force[d] -= coeff * delta[d];
+        }
     }
 
 
 //Utility functions
-    static std::vector<Body> getUninitializedBodies(long count){
-        std::vector<Body> res{};
+    static std::vector<Body<D>> getUninitializedBodies(long count){
+        std::vector<Body<D>> res{};
         res.reserve(count);
         for(long i = 0; i < count; i++){
-            res.push_back(Body{});
+            res.push_back(Body<D>{});
         }
         return res;
     }
@@ -416,29 +1117,86 @@ public:
     }
 };
 
-EMSCRIPTEN_BINDINGS(Layout){
-    emscripten::class_<Layout>("WASMLayout")
-    .constructor<std::vector<Body>,
+//The models the js side can choose between at construction
+template <int D>
+using ClassicLayout = Layout<D, InverseSquareRepulsion, HookeAttraction, LinearDrag>;
+template <int D>
+using ForceAtlas2Layout = Layout<D, DegreeWeightedRepulsion, LinLogAttraction, LinearDrag>;
+template <int D>
+using FruchtermanReingoldLayout = Layout<D, FruchtermanReingoldRepulsion, FruchtermanReingoldAttraction, LinearDrag>;
+
+template <int D, class L>
+void registerLayout(const char* name){
+    emscripten::class_<L>(name)
+    .template constructor<std::vector<Body<D>>,
         std::vector<Spring>,
         float, float, float, float>()
-    .function("step", &Layout::step)
-    .function("getGraphRect", &Layout::getGraphRect)
-    .function("pinNode", &Layout::pinNode)
-    .function("isNodePinned", &Layout::isNodePinned)
-    .function("dispose", &Layout::dispose)
-    .function("getBody", &Layout::getBody)
-    .function("setBody", &Layout::setBody)
-    .function("getSpring", &Layout::getSpring)
-    .function("setSpring", &Layout::setSpring)
-    .function("removeBody", &Layout::removeBody)
-    .function("removeLink", &Layout::removeLink)
-    .function("getXResVals", &Layout::getXResVals)
-    .function("getYResVals", &Layout::getYResVals)
-    .class_function("getUninitializedSprings", &Layout::getUninitializedSprings)
-    .class_function("getUninitializedBodies", &Layout::getUninitializedBodies);
-    emscripten::register_vector<Body>("vector<Body>");
+    .function("step", &L::step)
+    .function("getGraphRect", &L::getGraphRect)
+    .function("pinNode", &L::pinNode)
+    .function("isNodePinned", &L::isNodePinned)
+    .function("dispose", &L::dispose)
+    .function("getBody", &L::getBody)
+    .function("setBody", &L::setBody)
+    .function("getSpring", &L::getSpring)
+    .function("setSpring", &L::setSpring)
+    .function("removeBody", &L::removeBody)
+    .function("removeLink", &L::removeLink)
+    .function("placeBody", &L::placeBody)
+    .function("getBodyOrderVersion", &L::getBodyOrderVersion)
+    .function("getBodyList", &L::getBodyList)
+    .function("getMemoryUsage", &L::getMemoryUsage)
+    .function("setForceEngine", &L::setForceEngine)
+    .function("getForceEngine", &L::getForceEngine)
+    .function("getXResVals", &L::getXResVals)
+    .function("getYResVals", &L::getYResVals)
+    .function("getResVals", &L::getResVals)
+    .function("measureForceError", &L::measureForceError)
+    .class_function("getUninitializedSprings", &L::getUninitializedSprings)
+    .class_function("getUninitializedBodies", &L::getUninitializedBodies);
+}
+
+EMSCRIPTEN_BINDINGS(Layout){
+    emscripten::value_object<MemoryUsage>("MemoryUsage")
+    .field("bodies", &MemoryUsage::bodies)
+    .field("springs", &MemoryUsage::springs)
+    .field("treeNodes", &MemoryUsage::treeNodes)
+    .field("buffers", &MemoryUsage::buffers)
+    .field("indexes", &MemoryUsage::indexes)
+    .field("total", &MemoryUsage::total)
+    .field("peak", &MemoryUsage::peak)
+    .field("heapUsed", &MemoryUsage::heapUsed)
+    .field("heapSize", &MemoryUsage::heapSize)
+    .field("heapMax", &MemoryUsage::heapMax);
+
+    emscripten::enum_<ForceEngine>("ForceEngine")
+    .value("AUTO", AUTO)
+    .value("BARNES_HUT", BARNES_HUT)
+    .value("DIRECT", DIRECT);
+
+    emscripten::value_object<ForceErrorStats>("ForceErrorStats")
+    .field("theta", &ForceErrorStats::theta)
+    .field("bodyCount", &ForceErrorStats::bodyCount)
+    .field("rmsError", &ForceErrorStats::rmsError)
+    .field("maxError", &ForceErrorStats::maxError)
+    .field("nodeVisits", &ForceErrorStats::nodeVisits)
+    .field("buildTime", &ForceErrorStats::buildTime)
+    .field("approxTime", &ForceErrorStats::approxTime)
+    .field("snapshotTime", &ForceErrorStats::snapshotTime)
+    .field("exactTime", &ForceErrorStats::exactTime);
+
+    registerLayout<2, ClassicLayout<2>>("WASMLayout");
+    registerLayout<2, ForceAtlas2Layout<2>>("WASMLayoutForceAtlas2");
+    registerLayout<2, FruchtermanReingoldLayout<2>>("WASMLayoutFruchtermanReingold");
+    registerLayout<3, ClassicLayout<3>>("WASMLayout3D");
+    registerLayout<3, ForceAtlas2Layout<3>>("WASMLayoutForceAtlas23D");
+    registerLayout<3, FruchtermanReingoldLayout<3>>("WASMLayoutFruchtermanReingold3D");
+    emscripten::register_vector<Body<2>>("vector<Body>");
+    emscripten::register_vector<Body<3>>("vector<Body3D>");
     emscripten::register_vector<Vector2D>("vector<Vector2D>");
+    emscripten::register_vector<Vector3D>("vector<Vector3D>");
     emscripten::register_vector<Spring>("vector<Spring>");
+    emscripten::register_vector<std::string>("vector<string>");
 }
 
 #endif
\ No newline at end of file
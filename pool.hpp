@@ -0,0 +1,91 @@
+#include <vector>
+#include <new>
+#include <utility>
+
+#ifndef POOL
+#define POOL
+//Arena for objects of a single type. Objects are carved out of
+//chunks of chunkSize objects, so objects allocated together sit
+//together in memory and there's one heap allocation per chunk
+//rather than per object. Destroyed objects go on a free list and
+//are reused before the chunks grow
+//There is no need to expose this to js
+template <class T>
+class Pool{
+    std::vector<T*> chunks{};
+    std::vector<T*> freeList{};
+    long chunkSize = 1024;
+    long chunkIdx = 0;//Chunk currently being carved up
+    long chunkUsed = 0;//Objects carved out of that chunk so far
+
+    T* allocate(){
+        T* res;
+        if(freeList.size() > 0){
+            res = freeList[freeList.size()-1];
+            freeList.pop_back();
+        } else {
+            if(chunkUsed == chunkSize){
+                chunkIdx++;
+                chunkUsed = 0;
+            }
+            if(chunkIdx >= chunks.size()){
+                chunks.push_back(static_cast<T*>(::operator new(chunkSize * sizeof(T))));
+            }
+            res = chunks[chunkIdx] + chunkUsed;
+            chunkUsed++;
+        }
+        return res;
+    }
+
+public:
+    Pool(){}
+
+    Pool(long chunkSize) : chunkSize(chunkSize) {}
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    template <class... Args>
+    T* create(Args&&... args){
+        return new (allocate()) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* obj){
+        obj->~T();
+        freeList.push_back(obj);
+    }
+
+//Bulk release - forgets every object at once, keeping the chunks
+//for reuse. Destructors are not run, so objects that need them
+//must be destroyed first
+    void clear(){
+        freeList.clear();
+        chunkIdx = 0;
+        chunkUsed = 0;
+    }
+
+//Bulk release that also hands the chunks back to the heap
+    void release(){
+        clear();
+        for(auto c: chunks){
+            ::operator delete(c);
+        }
+        chunks.clear();
+    }
+
+    void swap(Pool& o){
+        std::swap(chunks, o.chunks);
+        std::swap(freeList, o.freeList);
+        std::swap(chunkSize, o.chunkSize);
+        std::swap(chunkIdx, o.chunkIdx);
+        std::swap(chunkUsed, o.chunkUsed);
+    }
+
+    long bytesReserved(){ return chunks.size() * chunkSize * sizeof(T); }
+
+    ~Pool(){
+        release();
+    }
+};
+
+#endif
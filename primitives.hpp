@@ -1,23 +1,51 @@
 #include <cmath>
 #include <vector>
+#include <utility>
 #include <emscripten/emscripten.h>
 #include <emscripten/bind.h>
 
 #ifndef PRIMITIVES
 #define PRIMITIVES
 
-struct Vector2D{
+//Vectors are specialised per dimension so the js side gets plain
+//x, y(, z) fields. operator[] lets the engine loop over dimensions,
+//with the index folding to a field access once the loop is unrolled
+template <int D>
+struct Vector;
+
+template <>
+struct Vector<2>{
     float x = 0;
     float y = 0;
+
+    float& operator[](int i){ return i == 0 ? x : y; }
+    float operator[](int i) const { return i == 0 ? x : y; }
+};
+
+template <>
+struct Vector<3>{
+    float x = 0;
+    float y = 0;
+    float z = 0;
+
+    float& operator[](int i){ return i == 0 ? x : (i == 1 ? y : z); }
+    float operator[](int i) const { return i == 0 ? x : (i == 1 ? y : z); }
 };
 
+using Vector2D = Vector<2>;
+using Vector3D = Vector<3>;
+
+template <int D>
 struct Body{
-    Vector2D pos = {};
-    Vector2D force = {};
-    Vector2D velocity = {};
+    Vector<D> pos = {};
+    Vector<D> force = {};
+    Vector<D> velocity = {};
     int isPinned = 0;
     std::string id = {};//0 id for invalid structure
     float mass = 0;
+//Repulsive charge, set by the engine from mass and
+//degree. Not exposed to js
+    float charge = 0;
 
     Body(){}
 
@@ -28,7 +56,22 @@ struct Body{
         isPinned = o.isPinned;
         id = o.id;
         mass = o.mass;
+        charge = o.charge;
+    }
+
+//Lets the engine move bodies between pools without
+//copying the id
+    Body(Body&& o){
+        pos = o.pos;
+        force = o.force;
+        velocity = o.velocity;
+        isPinned = o.isPinned;
+        id = std::move(o.id);
+        mass = o.mass;
+        charge = o.charge;
     }
+
+    Body& operator=(const Body& o) = default;
 };
 
 struct Spring{
@@ -38,6 +81,10 @@ struct Spring{
     float weight = 0;
     float length = 0;
     float coeff = 0;
+//Positions of from and to in the engine's body storage, -1 if
+//that body isn't present. Not exposed to js
+    long fromIdx = -1;
+    long toIdx = -1;
 
     Spring(){}
 
@@ -48,88 +95,64 @@ struct Spring{
         weight = o.weight;
         length = o.length;
         coeff = o.coeff;
+        fromIdx = o.fromIdx;
+        toIdx = o.toIdx;
     }
 };
 
 //This should be a struct but isn't for embind
+//A node of a D dimensional space partitioning tree,
+//with 2^D children (4 for a quadtree, 8 for an octree)
+template <int D>
 class Node{
 public:
+    static const int childCount = 1 << D;
+
     Node(){
     }
 //get by copy js accessible, not settable
-    Body* body = nullptr;
-    Node* q0 = nullptr;
-    Node* q1 = nullptr;
-    Node* q2 = nullptr;
-    Node* q3 = nullptr;
+    Body<D>* body = nullptr;
+    Node* children[childCount] = {};
 //js accessible
-    float mass = 0;
-    float massX = 0;
-    float massY = 0;
-    float left = 0;
-    float right = 0;
-    float top = 0;
-    float bottom = 0;
+    float mass = 0;//Summed charge of the bodies below
+    Vector<D> massPos = {};//Charge weighted sum of positions
+    Vector<D> lo = {};//left, top(, near) corner
+    Vector<D> hi = {};//right, bottom(, far) corner
 
 //API necessary for embind to work
-    Body getBody() const {return (body == nullptr ? Body{} : *body);}
-
-//Deleting a node should delete all sub nodes
-//DANGER: Loops in node structure
-    ~Node(){
-        if(q0 != nullptr) delete q0;
-        if(q1 != nullptr) delete q1;
-        if(q2 != nullptr) delete q2;
-        if(q3 != nullptr) delete q3;
-    }
+    Body<D> getBody() const {return (body == nullptr ? Body<D>{} : *body);}
+    float getMassX() const {return massPos[0];}
+    float getMassY() const {return massPos[1];}
+    float getLeft() const {return lo[0];}
+    float getRight() const {return hi[0];}
+    float getTop() const {return lo[1];}
+    float getBottom() const {return hi[1];}
+
+//Nodes are owned by the tree's node pool, which releases a
+//whole tree at once, so there is no destructor
 
     Node* getChild(int idx){
-        if (idx == 0) return q0;
-        if (idx == 1) return q1;
-        if (idx == 2) return q2;
-        if (idx == 3) return q3;
+        if (idx >= 0 && idx < childCount) return children[idx];
         return nullptr;
     }
 
     void setChild(int idx, Node* child){
-        if (idx == 0) q0 = child;
-        if (idx == 1) q1 = child;
-        if (idx == 2) q2 = child;
-        if (idx == 3) q3 = child;
+        if (idx >= 0 && idx < childCount) children[idx] = child;
     }
 
     Node getChildCopy(int idx){
         return *(getChild(idx));
     }
-
-    void cache(std::vector<Node*>& cache){
-        if(q0 != nullptr) q0->cache(cache);
-        if(q1 != nullptr) q1->cache(cache);
-        if(q2 != nullptr) q2->cache(cache);
-        if(q3 != nullptr) q3->cache(cache);
-        cache.push_back(this);
-    }
-
-    void reset(){
-        this->body = nullptr;
-        this->q0 = nullptr;
-        this->q1 = nullptr;
-        this->q2 = nullptr;
-        this->q3 = nullptr;
-        this->mass = 0;
-        this->massX = 0;
-        this->massY = 0;
-        this->left = 0;
-        this->right = 0;
-        this->top = 0;
-        this->bottom = 0;
-    }
 };
 
-bool isSamePosition(Vector2D p1, Vector2D p2){
-    float dx = std::abs(p1.x - p2.x);
-    float dy = std::abs(p1.y - p2.y);
-    return dx < 1e-8 && dy < 1e-8;
+template <int D>
+bool isSamePosition(Vector<D> p1, Vector<D> p2){
+    for(int d = 0; d < D; d++){
+        if(!(std::abs(p1[d] - p2[d]) < 1e-8)){
+            return false;
+        }
+    }
+    return true;
 }
 
 //There is no need to expose this to js
@@ -166,13 +189,26 @@ EMSCRIPTEN_BINDINGS(primitives){
     .field("x", &Vector2D::x)
     .field("y", &Vector2D::y);
 
-    emscripten::value_object<Body>("Body")
-    .field("pos", &Body::pos)
-    .field("force", &Body::force)
-    .field("velocity", &Body::velocity)
-    .field("isPinned", &Body::isPinned)
-    .field("id", &Body::id)
-    .field("mass", &Body::mass);
+    emscripten::value_object<Vector3D>("Vector3D")
+    .field("x", &Vector3D::x)
+    .field("y", &Vector3D::y)
+    .field("z", &Vector3D::z);
+
+    emscripten::value_object<Body<2>>("Body")
+    .field("pos", &Body<2>::pos)
+    .field("force", &Body<2>::force)
+    .field("velocity", &Body<2>::velocity)
+    .field("isPinned", &Body<2>::isPinned)
+    .field("id", &Body<2>::id)
+    .field("mass", &Body<2>::mass);
+
+    emscripten::value_object<Body<3>>("Body3D")
+    .field("pos", &Body<3>::pos)
+    .field("force", &Body<3>::force)
+    .field("velocity", &Body<3>::velocity)
+    .field("isPinned", &Body<3>::isPinned)
+    .field("id", &Body<3>::id)
+    .field("mass", &Body<3>::mass);
 
     emscripten::value_object<Spring>("Spring")
     .field("from", &Spring::from)
@@ -184,17 +220,17 @@ EMSCRIPTEN_BINDINGS(primitives){
 
 //WE probably don't *need* to export these, but
 //for development it's probably useful
-    emscripten::class_<Node>("QTNode")
+    emscripten::class_<Node<2>>("QTNode")
     .constructor<>()
-    .property("mass", &Node::mass)
-    .property("massX", &Node::massX)
-    .property("massY", &Node::massY)
-    .property("left", &Node::left)
-    .property("right", &Node::right)
-    .property("top", &Node::top)
-    .property("bottom", &Node::bottom)
-    .function("getBody", &Node::getBody)
-    .function("getChild", &Node::getChildCopy);
+    .property("mass", &Node<2>::mass)
+    .property("massX", &Node<2>::getMassX)
+    .property("massY", &Node<2>::getMassY)
+    .property("left", &Node<2>::getLeft)
+    .property("right", &Node<2>::getRight)
+    .property("top", &Node<2>::getTop)
+    .property("bottom", &Node<2>::getBottom)
+    .function("getBody", &Node<2>::getBody)
+    .function("getChild", &Node<2>::getChildCopy);
 
 }
 
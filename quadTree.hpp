@@ -1,15 +1,19 @@
 #include "primitives.hpp"
+#include "pool.hpp"
 #include <unordered_map>
 #include <random>
+#include <algorithm>
 #include <emscripten/bind.h>
 
 #ifndef QUADTREE
 #define QUADTREE
-class QuadTree{
+//A quadtree for D = 2, an octree for D = 3
+template <int D>
+class SpaceTree{
 
-    InsertStack<std::pair<Node*, Body*>> stack{};
+    InsertStack<std::pair<Node<D>*, Body<D>*>> stack{};
 
-    Node* root = nullptr;
+    Node<D>* root = nullptr;
 
     std::uniform_real_distribution<float> randomDist{0,1};
     std::default_random_engine re;
@@ -18,125 +22,133 @@ class QuadTree{
         return randomDist(re);
     }
 
-    std::vector<Node*> nodeCache{};
+//Every node of the current tree. The whole tree is released
+//in one go at the start of each insertBodies
+    Pool<Node<D>> nodes{4096};
 
-    Node* getNode(){
-        Node* res;
-        if(nodeCache.size() < 1){
-            res = new Node();
-        } else {
-            res = nodeCache[nodeCache.size()-1];
-            nodeCache.pop_back();
-            res->reset();
-        }
-        return res;
-    }
-
-//Adds a node and all it's sub-nodes to the node cache
-    void cacheNodes(Node* n){
-        n->cache(nodeCache);
+    Node<D>* getNode(){
+        return nodes.create();
     }
 
 public:
-    Node* getRoot(){ return root; }
+    Node<D>* getRoot(){ return root; }
+
+    SpaceTree(){}
 
-    QuadTree(){
-//We prealloc and cache a shit tonne of nodes
-        for(int i = 0; i < 1024; i++){
-            Node* n = new Node();
-            n->cache(nodeCache);
+//Bytes of node storage reserved
+    long bytesReserved(){ return nodes.bytesReserved(); }
+
+    void insertBodies(const std::vector<Body<D>*>& bodies){
+//Clean up from the last iteration
+        nodes.clear();
+        root = nullptr;
+        Vector<D> lo{};
+        Vector<D> hi{};
+//Find out initial bounding box
+        for(auto b: bodies){
+            auto pos = b->pos;
+            for(int d = 0; d < D; d++){
+                if (pos[d] < lo[d]) {
+                    lo[d] = pos[d];
+                }
+                if (pos[d] > hi[d]) {
+                    hi[d] = pos[d];
+                }
+            }
+        }
+//Square it up along the longest side
+        float extent = 0;
+        for(int d = 0; d < D; d++){
+            extent = std::max(extent, hi[d] - lo[d]);
+        }
+        for(int d = 0; d < D; d++){
+            hi[d] = lo[d] + extent;
+        }
+        root = this->getNode();
+        root->lo = lo;
+        root->hi = hi;
+        for(auto b: bodies){
+            insert(b, root);
         }
     }
 
-    void insertBodies(std::unordered_map<std::string, Body*> bodies){
-        if(root != nullptr){//Clean up from the last iteration. TODO - offload deletion to a different thread
-            cacheNodes(root);
-            root = nullptr;
+//Appends bodies within radius of centre to res, stopping once res
+//holds maxCount bodies. Subtrees whose box is entirely outside the
+//radius are skipped, so the cost depends on the size of the region
+//rather than the size of the tree
+    void collectBodies(Vector<D> centre, float radius, long maxCount, std::vector<Body<D>*>& res){
+        if(root == nullptr){
+            return;
         }
-        float x1 = 0;
-        float y1 = 0;
-        float x2 = 0;
-        float y2 = 0;
-        int max = bodies.size();
-//Find out initial bounding box
-        for(auto p: bodies){
-            float x = std::get<1>(p)->pos.x;
-            float y = std::get<1>(p)->pos.y;
-            if (x < x1) {
-                x1 = x;
+        std::vector<Node<D>*> queue{root};
+        float radius2 = radius * radius;
+        while(queue.size() > 0 && res.size() < maxCount){
+            auto node = queue[queue.size()-1];
+            queue.pop_back();
+//Distance from centre to the closest point of the node's box
+            float dist2 = 0;
+            for(int d = 0; d < D; d++){
+                float closest = std::min(std::max(centre[d], node->lo[d]), node->hi[d]);
+                dist2 += (centre[d] - closest) * (centre[d] - closest);
             }
-            if (x > x2) {
-                x2 = x;
+            if(dist2 > radius2){
+                continue;
             }
-            if (y < y1) {
-                y1 = y;
+            if(node->body != nullptr){
+                float bodyDist2 = 0;
+                for(int d = 0; d < D; d++){
+                    float diff = node->body->pos[d] - centre[d];
+                    bodyDist2 += diff * diff;
+                }
+                if(bodyDist2 <= radius2){
+                    res.push_back(node->body);
+                }
             }
-            if (y > y2) {
-                y2 = y;
+            for(int c = 0; c < Node<D>::childCount; c++){
+                if(node->children[c] != nullptr){
+                    queue.push_back(node->children[c]);
+                }
             }
         }
-        float dx = x2 - x1;
-        float dy = y2 - y1;
-        if(dx > dy){
-            y2 = y1+dx;
-        } else {
-            x2 = x1 + dy;
-        }
-        root = this->getNode();
-        root->left = x1;
-        root->right = x2;
-        root->top = y1;
-        root->bottom = y2;
-        if(bodies.size() >= 0){
-            root->body = std::get<1>(*(bodies.begin()));
-        }
-        for(auto p: bodies){
-            insert(std::get<1>(p), root);
-        }
     }
 
-    void insert(Body* newBody, Node* root){
+    void insert(Body<D>* newBody, Node<D>* root){
         stack.reset();
         stack.push({root, newBody});
         while(!stack.isEmpty()){
             auto stackItem = stack.pop();
-            Node* node = std::get<0>(stackItem);
-            Body* body = std::get<1>(stackItem);
+            Node<D>* node = std::get<0>(stackItem);
+            Body<D>* body = std::get<1>(stackItem);
             if(node->body == nullptr){
-                float x = body->pos.x;
-                float y = body->pos.y;
-                node->mass += body->mass;
-                node->massX += body->mass * x;
-                node->massY += body->mass * y;
-                int quadIdx = 0;
-                float left = node->left;
-                float right = (node->right + left)/2.0;
-                float top = node->top;
-                float bottom = (node->bottom + top)/2.0;
-                if(x > right){
-                    quadIdx += 1;
-                    left = right;
-                    right = node->right;
-                }
-                if(y > bottom){
-                    quadIdx += 2;
-                    top = bottom;
-                    bottom = node->bottom;
+                node->mass += body->charge;
+                int childIdx = 0;
+                Vector<D> lo{};
+                Vector<D> hi{};
+                for(int d = 0; d < D; d++){
+                    float p = body->pos[d];
+                    node->massPos[d] += body->charge * p;
+                    float mid = (node->hi[d] + node->lo[d])/2.0;
+                    if(p > mid){
+                        childIdx += 1 << d;
+                        lo[d] = mid;
+                        hi[d] = node->hi[d];
+                    } else {
+                        lo[d] = node->lo[d];
+                        hi[d] = mid;
+                    }
                 }
-                Node* child = node->getChild(quadIdx);
+                Node<D>* child = node->getChild(childIdx);
                 if(child == nullptr){
                     child = this->getNode();
-                    child->left = left;
-                    child-> right = right;
-                    child->top = top;
-                    child->bottom = bottom;
+                    child->lo = lo;
+                    child->hi = hi;
                     child->body = body;
-                    node->setChild(quadIdx, child);
+                    node->setChild(childIdx, child);
                 } else {
                     stack.push({child, body});
                 }
             } else {
-                Body* oldBody = node->body;
+                Body<D>* oldBody = node->body;
                 node->body = nullptr;
                 int retries = 3;
                 if(oldBody == body){
@@ -144,10 +156,9 @@ public:
                 }
                 while(retries > 0 && isSamePosition(oldBody->pos, body->pos)){
                     retries--;
-                    float dx = (node->right - node->left) * random();
-                    float dy = (node->bottom - node->top) * random();
-                    oldBody->pos.x = node->left + dx;
-                    oldBody->pos.y = node->top + dy;
+                    for(int d = 0; d < D; d++){
+                        oldBody->pos[d] = node->lo[d] + (node->hi[d] - node->lo[d]) * random();
+                    }
                 }
                 if(isSamePosition(oldBody->pos, body->pos)){
                     return;
@@ -157,12 +168,9 @@ public:
             }
         }
     }
-
-    ~QuadTree(){
-        if(root != nullptr){
-            delete root;
-        }
-    }
 };
 
-#endif
\ No newline at end of file
+using QuadTree = SpaceTree<2>;
+using OctTree = SpaceTree<3>;
+
+#endif
@@ -353,6 +353,8 @@ function launchNetworkRendering(){
         dragCoeff: drag,
         gravity: -1.0*repulsion,
         theta: 0.8,//Single biggest performance impacting value
+        model: "classic",//Or "forceAtlas2", "fruchtermanReingold"
+        dimensions: 2,//3 for an octree layout, rendering uses x and y
         springTransform: (link, spring) => {
             spring.length = baseLength * link.data.weight;
             //spring.coeff = link.data.class == "reply" ? 0.0015 : 0.00000001;